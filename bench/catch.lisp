@@ -0,0 +1,53 @@
+; Catch-heavy loops, a microbenchmark of catch and throw.
+; Does not need the prelude, raise NCELLS to 1 << 23 or more, build and run:
+;   time ./yordle bench/catch.lisp < /dev/null
+
+; n catches of an expression that does not throw
+(define guarded
+    (lambda (n)
+      (if (< 0 n)
+          (let* (_ (catch n))
+            (guarded (- n 1)))
+          n)))
+
+; n catches of cdr probing a number, as pair? in the prelude does
+(define probing
+    (lambda (n)
+      (if (< 0 n)
+          (let* (_ (catch (cdr n)))
+            (probing (- n 1)))
+          n)))
+
+; n catches of a throw from a nested call that allocated temporaries
+(define unwind
+    (lambda (n d)
+      (if (< 0 d)
+          (unwind (cons n (cons n n)) (- d 1))
+          (throw 1 d))))
+
+(define unwinding
+    (lambda (n)
+      (if (< 0 n)
+          (let* (_ (catch (unwind n 8)))
+            (unwinding (- n 1)))
+          n)))
+
+; n catches of a throw with no payload, as car of nil throws, from a nested
+; call that allocated temporaries
+(define fail
+    (lambda (n d)
+      (if (< 0 d)
+          (fail (cons n (cons n n)) (- d 1))
+          (car ()))))
+
+(define failing
+    (lambda (n)
+      (if (< 0 n)
+          (let* (_ (catch (fail n 8)))
+            (failing (- n 1)))
+          n)))
+
+(guarded 200000)
+(probing 200000)
+(unwinding 50000)
+(failing 50000)
@@ -0,0 +1,37 @@
+; Call-heavy loops, a microbenchmark of eval and apply dispatch.
+; Does not need the prelude, raise NCELLS to 1 << 24 or more, build and run:
+;   sed -i 's/^#define NCELLS .*/#define NCELLS (1 << 24)/' yordle.c
+;   cc -O2 yordle.c -o yordle -lreadline
+;   time ./yordle bench/dispatch.lisp < /dev/null
+
+; doubly recursive arithmetic, mostly primitive and closure applications
+(define fib
+    (lambda (n)
+      (if (< n 2)
+          n
+          (+ (fib (- n 1)) (fib (- n 2))))))
+
+; the list (1 2 ... n) prepended to t
+(define upto
+    (lambda (n t)
+      (if (< 0 n)
+          (upto (- n 1) (cons n t))
+          t)))
+
+; n plus the length of t, mostly car and cdr
+(define len
+    (lambda (t n)
+      (if t
+          (len (cdr t) (+ n 1))
+          n)))
+
+; k times build and walk a list of 300 numbers
+(define walking
+    (lambda (k)
+      (if (< 0 k)
+          (let* (_ (len (upto 300 ()) 0))
+            (walking (- k 1)))
+          k)))
+
+(fib 27)
+(walking 300)
@@ -49,11 +49,34 @@ unsigned g_stack_pointer = NCELLS;
 /* Different types of Lisp expressions are encoded using NaN Boxing.
  * These tags are part of the fraction part of a IEEE 754 floating point NaN.
  * We're using quiet NaNs, so we have 51 bits and the sign bits to store the
- * tag, as well as the actual data */
-unsigned g_ATOM = 0x7ff8, g_PRIM = 0x7ff9, g_CONS = 0x7ffa, g_CLOS = 0x7ffb,
-         g_MACR = 0x7ffc, g_NIL = 0x7ffd;
+ * tag, as well as the actual data. The tags are constants so that the
+ * compiler can fold the tag checks that follow from one another */
+const unsigned g_ATOM = 0x7ff8, g_PRIM = 0x7ff9, g_CODE = 0x7ffa,
+               g_CONS = 0x7ffb, g_CLOS = 0x7ffc, g_MACR = 0x7ffd,
+               g_NIL = 0x7ffe, g_MEMO = 0x7fff;
 
-LispExpr g_cell[NCELLS];
+/* Number of distinct tags, the tags above are consecutive starting at g_ATOM */
+#define NTAGS 8
+
+/* Maximum number of elements following the first one in a cdr-coded list */
+#define CODED_MAX 0x7fff
+
+/* Bit above the count of a CODE that marks the car cell of a cdr-coded element
+ * whose cdr was changed by set-cdr! */
+#define FORWARDED 0x8000
+
+/* Number of elements that list() lays out at once from the C stack, longer
+ * lists are split in cdr-coded chunks, each ending with the next one */
+#define CHUNK_SIZE 16
+
+/* Maximum number of results cached across all memoized functions */
+#define MEMO_SIZE 1024
+
+/* Number of pairs for the copies of the arguments and values of the cached
+ * results, kept in the cells above NCELLS where gc leaves them alone */
+#define MEMO_PAIRS 1024
+
+LispExpr g_cell[NCELLS + 2 * MEMO_PAIRS];
 
 /* nil represents the smpty lisp and is also considred false */
 LispExpr g_nil, g_true, g_env;
@@ -68,7 +91,63 @@ FILE *g_in = NULL;
 
 TraceState g_trace_state;
 
-jmp_buf g_jmp_context;
+/* Should closures of top-level lambdas be optimized when constructed? */
+unsigned g_optimize = 0;
+
+/* Bumped whenever a global binding that optimized closures may have folded
+ * into their bodies is redefined or assigned, see foldable() */
+unsigned g_stamp = 0;
+
+/* A handler of a catch, or of the REPL at the bottom of the handler stack.
+ * Handlers live in the C stack frames of f_catch() and are linked to the
+ * enclosing handler, so installing one does not copy any jmp_buf.
+ * A throw resumes the innermost handler with the stack pointer it recorded,
+ * reclaiming the temporaries allocated since the handler was installed */
+typedef struct Handler {
+  jmp_buf context;
+  unsigned stack_pointer;
+  struct Handler *prev;
+} Handler;
+
+/* Innermost handler */
+Handler *g_handler;
+
+/* The offending expression of the last error thrown */
+LispExpr g_culprit;
+
+/* Lowest cell that a throw must not reclaim. Global definitions, assignments,
+ * set-car! and set-cdr! can make cells allocated inside a
+ * catch reachable from outside of it, so they pin the stack down to where it
+ * is, see pin() */
+unsigned g_pinned = NCELLS;
+
+/* Cells above this one are kept by gc() like the global environment. It is
+ * lowered by set-cdr! when it forwards a cdr-coded element that gc() keeps */
+unsigned g_kept = NCELLS;
+
+/* A cached result value of applying the memoized function memo to the
+ * evaluated argument list args, both copied to the cells above NCELLS.
+ * Entries sit in a hash bucket chain and in
+ * the LRU list, which runs from the newest entry (g_memo[MEMO_SIZE].older)
+ * to the oldest entry (g_memo[MEMO_SIZE].newer). Free entries have memo 0
+ * and are kept at the oldest end */
+typedef struct {
+  unsigned memo;
+  unsigned hash;
+  LispExpr args, value;
+  unsigned next;
+  unsigned newer, older;
+} MemoEntry;
+
+/* g_memo[MEMO_SIZE] is the head of the LRU list */
+MemoEntry g_memo[MEMO_SIZE + 1];
+/* First entry of each hash bucket, MEMO_SIZE if the bucket is empty */
+unsigned g_memo_bucket[MEMO_SIZE];
+/* List of the free pairs above NCELLS and its length */
+LispExpr g_memo_free;
+unsigned g_memo_pairs = MEMO_PAIRS;
+/* No used entry has a memo below this cell */
+unsigned g_memo_low = NCELLS;
 
 /* Returns a new tagged NaN-boxed double with ordinal content data */
 LispExpr box(unsigned tag, unsigned data) {
@@ -80,7 +159,69 @@ LispExpr box(unsigned tag, unsigned data) {
 /* Returns the ordinal (data/paylaod) of the NaN-boxed x */
 unsigned ord(LispExpr x) { return *(uint64_t *)&x; }
 
-LispExpr err(ErrorCode i) { longjmp(g_jmp_context, (int)i); }
+/* Returns the number of elements following x if x is a CODE element of a
+ * cdr-coded list, 0 if x is an ordinary pair or the last element of a list */
+unsigned coded(LispExpr x) { return *(uint64_t *)&x >> 32 & CODED_MAX; }
+
+/* Returns a CODE referencing the element in cell i + 1 of a cdr-coded list,
+ * followed by n more elements in the cells below. The last element has no
+ * more elements following it and is an ordinary CONS pair */
+LispExpr coded_pair(unsigned n, unsigned i) {
+  LispExpr x;
+  *(uint64_t *)&x =
+      (uint64_t)(n ? g_CODE : g_CONS) << 48 | (uint64_t)n << 32 | i;
+  return x;
+}
+
+/* Returns the marker that forwards a cdr-coded element to the pair in cell i,
+ * which holds the car and the cdr of the element from then on */
+LispExpr forward(unsigned i) {
+  LispExpr x;
+  *(uint64_t *)&x = (uint64_t)g_CODE << 48 | (uint64_t)FORWARDED << 32 | i;
+  return x;
+}
+
+/* Check if the car cell x of a cdr-coded element forwards it to a pair */
+unsigned is_forward(LispExpr x) {
+  return TAG_BITS(x) == g_CODE && *(uint64_t *)&x >> 32 & FORWARDED;
+}
+
+/* Returns the index of the tag of x into the per-tag dispatch tables.
+ * ATOM to MEMO map to 0 to NTAGS - 1, every number shares the last slot NTAGS */
+unsigned tag(LispExpr x) {
+  unsigned t = (TAG_BITS(x)) - g_ATOM;
+  return t < NTAGS ? t : NTAGS;
+}
+
+/* Check if x is a CONS, CLOS or MACR pair. The three tags are consecutive, so
+ * a single unsigned range comparison replaces three tag comparisons */
+unsigned is_pair(LispExpr x) { return (TAG_BITS(x)) - g_CONS <= g_MACR - g_CONS; }
+
+/* Check if x is a list element, a CODE element of a cdr-coded list or a CONS */
+unsigned is_cons(LispExpr x) { return (TAG_BITS(x)) - g_CODE <= g_CONS - g_CODE; }
+
+/* Check if x references cells, as list elements, pairs and memo objects do */
+unsigned references(LispExpr x) {
+  return is_cons(x) || is_pair(x) || TAG_BITS(x) == g_MEMO;
+}
+
+void unmemo();
+
+/* Throw error i with the offending expression x to the innermost handler */
+LispExpr err(ErrorCode i, LispExpr x) {
+  Handler *h = g_handler;
+  g_handler = h->prev;
+  g_culprit = x;
+  if (!references(x) || ord(x) >= h->stack_pointer) { // unless x references
+    g_stack_pointer =                                 // temporary cells
+        h->stack_pointer < g_pinned ? h->stack_pointer : g_pinned;
+    unmemo();
+  }
+  longjmp(h->context, (int)i);
+}
+
+/* Keep the cells allocated so far from being reclaimed by a throw */
+void pin() { g_pinned = g_stack_pointer; }
 
 /* Returns the NaN-boxed without the tag.
  * This currently passes NaNs to perform arithmetic on, resulting in a NaN.
@@ -110,7 +251,7 @@ LispExpr atom(const char *s) {
                          1) >     // alocate and add a new atom name to the heap
           g_stack_pointer << 3) { // heap ptr points to bytes, stack ptr points
                                   // to 8-byte float
-    err(OUT_OF_MEMORY);
+    err(OUT_OF_MEMORY, g_nil);
   }
   return box(g_ATOM, i);
 }
@@ -119,26 +260,76 @@ LispExpr atom(const char *s) {
  * Lisp uses linked lists with the car of a pair containing the list element
  * and the cdr pointing to the next cons pair (or nil) */
 LispExpr cons(LispExpr x, LispExpr y) {
+  if (g_heap_pointer > (g_stack_pointer - 2) << 3) { // before the cells
+    err(OUT_OF_MEMORY, g_nil);                      // overwrite atom names
+  }
   g_cell[--g_stack_pointer] = x; // push the car value in the stack
   g_cell[--g_stack_pointer] = y; // push the cdr value in the stack
-  if (g_heap_pointer > g_stack_pointer << 3) {
-    err(OUT_OF_MEMORY);
-  }
   return box(g_CONS, g_stack_pointer);
 }
 
-/* Get the car cell of the pair */
+/* Allocate n consecutive cells on the stack, returns the lowest one */
+unsigned reserve(unsigned n) {
+  if (n > g_stack_pointer || g_heap_pointer > (g_stack_pointer - n) << 3) {
+    err(OUT_OF_MEMORY, g_nil);
+  }
+  return g_stack_pointer -= n;
+}
+
+/* A cdr-coded list of n values v followed by the tail t takes n + 1 cells
+ * instead of 2n, with v[0] in the highest cell down to t in the lowest.
+ * Each element is referenced by a CODE that also counts the elements after
+ * it, so the cdr of an element is the next cell down until the last
+ * element, which is an ordinary pair with t as its cdr */
+LispExpr cdr_code(LispExpr *v, unsigned n, LispExpr t) {
+  unsigned i;
+  if (n == 0) {
+    return t;
+  }
+
+  i = reserve(n + 1);
+  g_cell[i] = t;
+  for (unsigned k = 0; k < n; ++k) {
+    g_cell[i + n - k] = v[k];
+  }
+  return coded_pair(n - 1, i + n - 1);
+}
+
+/* Returns the index of the cell above which the car of p is, p is a pair or
+ * a cdr-coded element, following the element to its pair if it is forwarded */
+unsigned car_cell(LispExpr p) {
+  LispExpr x = g_cell[ord(p) + 1];
+  return TAG_BITS(p) == g_CODE && is_forward(x) ? ord(x) : ord(p);
+}
+
+/* Get the car of p if it is not a pair. The car cell of a cdr-coded element
+ * is the one above its reference, unless set-cdr! forwarded the element */
+LispExpr coded_car(LispExpr p) {
+  return TAG_BITS(p) == g_CODE ? g_cell[car_cell(p) + 1]
+                               : err(INV_CAR_OR_CDR, p);
+}
+
+/* Get the cdr of p if it is not a pair. The cdr of a cdr-coded element is
+ * the next element, one cell down and followed by one element less, unless
+ * set-cdr! forwarded the element */
+LispExpr coded_cdr(LispExpr p) {
+  LispExpr x;
+  if (TAG_BITS(p) != g_CODE) {
+    return err(INV_CAR_OR_CDR, p);
+  }
+  x = g_cell[ord(p) + 1];
+  return is_forward(x) ? g_cell[ord(x)] : coded_pair(coded(p) - 1, ord(p) - 1);
+}
+
+/* Get the car cell of the pair, cdr-coded elements are left to coded_car() so
+ * that pairs take the same short path as before */
 LispExpr car(LispExpr p) {
-  return TAG_BITS(p) == g_CONS || TAG_BITS(p) == g_CLOS || TAG_BITS(p) == g_MACR
-             ? g_cell[ord(p) + 1]
-             : err(INV_CAR_OR_CDR);
+  return is_pair(p) ? g_cell[ord(p) + 1] : coded_car(p);
 }
 
-/* Get the cdr cell of the pair */
+/* Get the cdr cell of the pair, cdr-coded elements are left to coded_cdr() */
 LispExpr cdr(LispExpr p) {
-  return TAG_BITS(p) == g_CONS || TAG_BITS(p) == g_CLOS || TAG_BITS(p) == g_MACR
-             ? g_cell[ord(p)]
-             : err(INV_CAR_OR_CDR);
+  return is_pair(p) ? g_cell[ord(p)] : coded_cdr(p);
 }
 
 /* First construct the name-value Lisp pair (v . x),
@@ -167,27 +358,46 @@ LispExpr closure(LispExpr v, LispExpr x, LispExpr e) {
 /* Construct a macro */
 LispExpr macro(LispExpr v, LispExpr x) { return box(g_MACR, ord(cons(v, x))); }
 
+/* Find the name-value pair (v . x) of a symbol in an environment,
+ * returns nil if v is unbound. Environments are only ever constructed by
+ * pair() out of ordinary pairs, so their cells are read directly without the
+ * tag checks of car() and cdr(). This is the hottest loop of the interpreter */
+LispExpr binding(LispExpr v, LispExpr e) {
+  while (TAG_BITS(e) == g_CONS && !eq(v, g_cell[ord(g_cell[ord(e) + 1]) + 1])) {
+    e = g_cell[ord(e)];
+  }
+  return TAG_BITS(e) == g_CONS ? g_cell[ord(e) + 1] : g_nil;
+}
+
 /* Look up a symbol in an environment.
  * An environment in Lisp is implemented as a list of name-value associations,
  * where names are Lisp atoms */
 LispExpr assoc(LispExpr v, LispExpr e) {
-  while (TAG_BITS(e) == g_CONS && !eq(v, car(car(e)))) {
-    e = cdr(e);
-  }
-  return TAG_BITS(e) == g_CONS ? cdr(car(e)) : err(SYM_NOT_FOUND);
+  LispExpr b = binding(v, e);
+  return not(b) ? err(SYM_NOT_FOUND, v) : cdr(b);
+}
+
+/* Check if the value x of the global v may be folded into optimized closures.
+ * Those are primitives, closures and symbols bound to themselves like #t */
+unsigned foldable(LispExpr v, LispExpr x) {
+  return TAG_BITS(x) == g_PRIM || TAG_BITS(x) == g_CLOS || eq(v, x);
 }
 
 unsigned let(LispExpr t) { return TAG_BITS(t) != g_NIL && !not(cdr(t)); }
 
 LispExpr step(LispExpr, LispExpr);
 
+LispExpr eval_trace(LispExpr, LispExpr);
+
+/* The evaluator currently in use. Without tracing this is step itself, so
+ * evaluation pays nothing for the trace hooks. (trace n) swaps in eval_trace */
+LispExpr (*eval)(LispExpr, LispExpr) = step;
+
 void print(LispExpr);
 
-LispExpr eval(LispExpr x, LispExpr e) {
+/* Tracing variant of eval, prints every step and optionally waits for input */
+LispExpr eval_trace(LispExpr x, LispExpr e) {
   LispExpr y = step(x, e);
-  if (g_trace_state == NO_TRACE) {
-    return y;
-  }
 
   printf("%u: ", g_stack_pointer);
   print(x);
@@ -202,18 +412,32 @@ LispExpr eval(LispExpr x, LispExpr e) {
   return y;
 }
 
+/* Evaluate the expressions of the list t into a cdr-coded list, laid out in
+ * the cells reserved for it before evaluating the first expression */
 LispExpr evlis(LispExpr t, LispExpr e) {
-  LispExpr s;
-  LispExpr *p;
-  for (s = g_nil, p = &s; TAG_BITS(t) == g_CONS;
-       p = g_cell + g_stack_pointer, t = cdr(t)) {
-    *p = cons(eval(car(t), e), g_nil);
+  unsigned n = 0, i, k;
+  LispExpr u;
+  if (TAG_BITS(t) == g_CODE) { // the elements of a cdr-coded list count
+    while (n < coded(t) && !is_forward(g_cell[ord(t) + 1 - n])) { // themselves
+      ++n;                     // up to the first forwarded one
+    }
+    ++n;
+  } else {
+    for (u = t; is_cons(u) && n <= CODED_MAX; u = cdr(u)) {
+      ++n;
+    }
   }
 
-  if (TAG_BITS(t) == g_ATOM) {
-    *p = assoc(t, e);
+  if (n == 0) {
+    return TAG_BITS(t) == g_ATOM ? assoc(t, e) : g_nil;
   }
-  return s;
+
+  i = reserve(n + 1);
+  for (k = n; k; --k, t = cdr(t)) {
+    g_cell[i + k] = eval(car(t), e);
+  }
+  g_cell[i] = evlis(t, e);
+  return coded_pair(n - 1, i + n - 1);
 }
 
 /* Lisp builtins:
@@ -277,7 +501,15 @@ LispExpr evlis(LispExpr t, LispExpr e) {
  *     (println e)
  *     (catch e)           catch exceptions during evaluation of e
  *     (throw n)           throw exception with error code n
- *     (trace n)           change current tracing status, n can be 0|1|2 */
+ *     (trace n)           change current tracing status, n can be 0|1|2
+ *     (memoize f)         wrap closure f with a cache of its results keyed by
+ *                         its evaluated arguments
+ *     (memo-stats m)      (hits . misses) of the cache of memoized m
+ *     (optimize n)        optimize the bodies of top-level lambdas
+ *                         constructed from now on if n is 1, stop if n is 0
+ *     (guard n x y)       evaluate x if no global binding folded into x
+ *                         changed since stamp n, otherwise evaluate y.
+ *                         Optimized closure bodies are wrapped in a guard */
 
 LispExpr f_eval(LispExpr t, LispExpr e) { return eval(car(evlis(t, e)), e); }
 
@@ -375,20 +607,37 @@ LispExpr f_leta(LispExpr t, LispExpr e) {
   return eval(car(t), e);
 }
 
+LispExpr optimize(LispExpr, LispExpr);
+
 LispExpr f_lambda(LispExpr t, LispExpr e) {
-  return closure(car(t), car(cdr(t)), e);
+  return closure(car(t),
+                 g_optimize && eq(e, g_env) ? optimize(car(t), car(cdr(t)))
+                                            : car(cdr(t)),
+                 e);
 }
 
 LispExpr f_macro(LispExpr t, LispExpr e) { return macro(car(t), car(cdr(t))); }
 
 LispExpr f_define(LispExpr t, LispExpr e) {
-  g_env = pair(car(t), eval(car(cdr(t)), e), g_env);
+  LispExpr x = eval(car(cdr(t)), e);
+  LispExpr b = binding(car(t), g_env);
+  if (!not(b) && foldable(car(t), cdr(b))) {
+    ++g_stamp;
+  }
+  g_env = pair(car(t), x, g_env);
+  pin();
   return car(t);
 }
 
+/* The list e given to assoc may be any list, so it is walked with car and
+ * cdr rather than with binding() */
 LispExpr f_assoc(LispExpr t, LispExpr e) {
-  t = evlis(t, e);
-  return assoc(car(t), car(cdr(t)));
+  LispExpr v = car(t = evlis(t, e));
+  for (e = car(cdr(t)); is_cons(e) && !eq(v, car(car(e)));
+       e = cdr(e)) {
+    continue;
+  }
+  return is_cons(e) ? cdr(car(e)) : err(SYM_NOT_FOUND, v);
 }
 
 LispExpr f_env(LispExpr _, LispExpr e) { return e; }
@@ -412,22 +661,57 @@ LispExpr f_letreca(LispExpr t, LispExpr e) {
 LispExpr f_setq(LispExpr t, LispExpr e) {
   LispExpr v = car(t);
   LispExpr x = eval(car(cdr(t)), e);
-  while (TAG_BITS(e) == g_CONS && !eq(v, car(car(e)))) {
-    e = cdr(e);
+  LispExpr b = binding(v, e);
+  if (not(b)) {
+    return err(SYM_NOT_FOUND, v);
+  }
+  if (foldable(v, cdr(b)) && eq(b, binding(v, g_env))) {
+    ++g_stamp;
+  }
+  if (references(x)) {
+    pin();
   }
-  return TAG_BITS(e) == g_CONS ? g_cell[ord(car(e))] = x : err(SYM_NOT_FOUND);
+  return g_cell[ord(b)] = x;
 }
 
 LispExpr f_setcar(LispExpr t, LispExpr e) {
   t = evlis(t, e);
   LispExpr p = car(t);
-  return (TAG_BITS(p) == g_CONS) ? g_cell[ord(p) + 1] = car(cdr(t)) : err(SYM_NOT_FOUND);
+  LispExpr x = car(cdr(t));
+  if (!is_cons(p)) {
+    return err(SYM_NOT_FOUND, p);
+  }
+  if (references(x)) {
+    pin();
+  }
+  return g_cell[car_cell(p) + 1] = x;
 }
 
+/* A cdr-coded element has no cdr cell. The first set-cdr! moves its car to a
+ * new ordinary pair and leaves a forward() marker to that pair in its car
+ * cell. The new pair is kept from throws and, when gc() keeps the element,
+ * from gc() too */
 LispExpr f_setcdr(LispExpr t, LispExpr e) {
   t = evlis(t, e);
   LispExpr p = car(t);
-  return (TAG_BITS(p) == g_CONS) ? g_cell[ord(p)] = car(cdr(t)) : err(SYM_NOT_FOUND);
+  LispExpr x = car(cdr(t));
+  LispExpr f;
+  if (!is_cons(p)) {
+    return err(SYM_NOT_FOUND, p);
+  }
+  if (TAG_BITS(p) == g_CODE && !is_forward(g_cell[ord(p) + 1])) {
+    f = cons(g_cell[ord(p) + 1], x);
+    g_cell[ord(p) + 1] = forward(ord(f));
+    if (ord(p) > ord(g_env)) {
+      g_kept = g_stack_pointer;
+    }
+    pin();
+    return x;
+  }
+  if (references(x)) {
+    pin();
+  }
+  return g_cell[car_cell(p)] = x;
 }
 
 LispExpr read();
@@ -456,28 +740,59 @@ LispExpr f_println(LispExpr t, LispExpr e) {
   return g_nil;
 }
 
+/* Evaluates to (ERR n . x) when error n is thrown with the expression x */
 LispExpr f_catch(LispExpr t, LispExpr e) {
+  Handler h;
+  int status;
   LispExpr x;
-  int jmp_status;
-  jmp_buf saved_jmp_context;
 
-  memcpy(saved_jmp_context, g_jmp_context, sizeof(g_jmp_context));
-  jmp_status = setjmp(g_jmp_context);
-  x = jmp_status ? cons(atom("ERR"), jmp_status) : eval(car(t), e);
+  h.stack_pointer = g_stack_pointer;
+  h.prev = g_handler;
+  g_handler = &h;
+  if ((status = setjmp(h.context)) != 0) { // err() already popped the handler
+    return cons(atom("ERR"), cons(status, g_culprit));
+  }
 
-  memcpy(g_jmp_context, saved_jmp_context, sizeof(g_jmp_context));
+  x = eval(car(t), e);
+  g_handler = h.prev;
   return x;
 }
 
 LispExpr f_throw(LispExpr t, LispExpr e) {
-  longjmp(g_jmp_context, (int)num(car(t)));
+  t = evlis(t, e);
+  return err(num(car(t)), not(cdr(t)) ? g_nil : car(cdr(t)));
 }
 
 LispExpr f_trace(LispExpr t, LispExpr e) {
   g_trace_state = (TraceState) car(t);
+  eval = g_trace_state == NO_TRACE ? step : eval_trace;
+  return g_nil;
+}
+
+LispExpr f_optimize(LispExpr t, LispExpr e) {
+  g_optimize = (unsigned)num(car(t));
   return g_nil;
 }
 
+LispExpr f_guard(LispExpr t, LispExpr e) {
+  return eval(car(cdr(num(car(t)) == g_stamp ? t : cdr(t))), e);
+}
+
+/* A memoized function is a MEMO-tagged pair (f . (hits . misses)) */
+LispExpr f_memoize(LispExpr t, LispExpr e) {
+  LispExpr f = car(evlis(t, e));
+  return TAG_BITS(f) == g_CLOS ? box(g_MEMO, ord(cons(f, cons(0, 0))))
+                               : err(INV_FUN_TYPE, f);
+}
+
+LispExpr f_memo_stats(LispExpr t, LispExpr e) {
+  LispExpr m = car(evlis(t, e));
+  LispExpr s;
+  return TAG_BITS(m) == g_MEMO
+             ? (s = g_cell[ord(m)], cons(g_cell[ord(s) + 1], g_cell[ord(s)]))
+             : err(INV_FUN_TYPE, m);
+}
+
 struct {
   const char *s;
   LispExpr (*f)(LispExpr, LispExpr);
@@ -515,21 +830,29 @@ struct {
             {"catch", f_catch},
             {"throw", f_throw},
             {"trace", f_trace},
+            {"memoize", f_memoize},
+            {"memo-stats", f_memo_stats},
+            {"optimize", f_optimize},
+            {"guard", f_guard},
             {0}};
 
 /* Create environment by extending e with variables v bound to values t */
 LispExpr bind(LispExpr v, LispExpr t, LispExpr e) {
-  return TAG_BITS(v) == g_NIL    ? e
-         : TAG_BITS(v) == g_CONS ? bind(cdr(v), cdr(t), pair(car(v), car(t), e))
-                                 : pair(v, t, e);
+  return TAG_BITS(v) == g_NIL ? e
+         : is_cons(v)         ? bind(cdr(v), cdr(t), pair(car(v), car(t), e))
+                              : pair(v, t, e);
 }
 
-/* Apply closure f to the list of arguments t.
+/* Apply closure f to the list of already evaluated arguments t.
  * Notice that we use the fact that closures are constructed
  * to include their static scope or nil as their environment */
+LispExpr invoke(LispExpr f, LispExpr t) {
+  return eval(cdr(car(f)), bind(car(car(f)), t, not(cdr(f)) ? g_env : cdr(f)));
+}
+
+/* Apply closure f to the list of arguments t */
 LispExpr reduce(LispExpr f, LispExpr t, LispExpr e) {
-  return eval(cdr(car(f)),
-              bind(car(car(f)), evlis(t, e), not(cdr(f)) ? g_env : cdr(f)));
+  return invoke(f, evlis(t, e));
 }
 
 /* Application of macros is similar to lambdas, by they expand instead */
@@ -537,23 +860,546 @@ LispExpr expand(LispExpr f, LispExpr t, LispExpr e) {
   return eval(eval(cdr(f), bind(car(f), t, g_env)), e);
 }
 
+/* Hash an expression, atomic values by their NaN-box bits and lists
+ * structurally. The high half is folded in, because the low bits of
+ * small numbers are all zero */
+unsigned hash(LispExpr x) {
+  uint64_t h = 0;
+  for (; is_cons(x); x = cdr(x)) {
+    h = (h ^ hash(car(x))) * 0x100000001b3;
+  }
+  h = (h ^ *(uint64_t *)&x) * 0x100000001b3;
+  return h ^ h >> 32;
+}
+
+/* Structural equality of lists, identity of everything else */
+unsigned equal(LispExpr x, LispExpr y) {
+  for (; is_cons(x) && is_cons(y);
+       x = cdr(x), y = cdr(y)) {
+    if (!equal(car(x), car(y))) {
+      return 0;
+    }
+  }
+  return eq(x, y);
+}
+
+/* Remove entry i from the LRU list */
+void lru_unlink(unsigned i) {
+  g_memo[g_memo[i].newer].older = g_memo[i].older;
+  g_memo[g_memo[i].older].newer = g_memo[i].newer;
+}
+
+/* Insert entry i into the LRU list as the newest entry, or as the oldest */
+void lru_link(unsigned i, unsigned newest) {
+  MemoEntry *h = &g_memo[MEMO_SIZE];
+  if (newest) {
+    g_memo[i].newer = MEMO_SIZE;
+    g_memo[i].older = h->older;
+    g_memo[h->older].newer = i;
+    h->older = i;
+  } else {
+    g_memo[i].older = MEMO_SIZE;
+    g_memo[i].newer = h->newer;
+    g_memo[h->newer].older = i;
+    h->newer = i;
+  }
+}
+
+/* Number of pairs to copy x to the cells above NCELLS, more than MEMO_PAIRS
+ * if x references a closure, macro or memoized function, which is not copied */
+unsigned pairs(LispExpr x) {
+  unsigned n = 0;
+  for (; is_cons(x); x = cdr(x)) {
+    n += 1 + pairs(car(x));
+  }
+  return is_pair(x) || TAG_BITS(x) == g_MEMO ? MEMO_PAIRS + 1 : n;
+}
+
+/* Copy x to free pairs above NCELLS, as ordinary pairs */
+LispExpr memo_copy(LispExpr x) {
+  LispExpr p = g_memo_free;
+  if (!is_cons(x)) {
+    return x;
+  }
+  g_memo_free = g_cell[ord(p)];
+  --g_memo_pairs;
+  g_cell[ord(p) + 1] = memo_copy(car(x));
+  g_cell[ord(p)] = memo_copy(cdr(x));
+  return p;
+}
+
+/* Copy x from the pairs above NCELLS back onto the stack, so that callers
+ * never hold or change the pairs of a cached result */
+LispExpr memo_value(LispExpr x) {
+  return TAG_BITS(x) == g_CONS ? cons(memo_value(g_cell[ord(x) + 1]),
+                                      memo_value(g_cell[ord(x)]))
+                               : x;
+}
+
+/* Return the pairs of x copied by memo_copy() to the free list */
+void memo_free(LispExpr x) {
+  if (TAG_BITS(x) == g_CONS) {
+    memo_free(g_cell[ord(x) + 1]);
+    memo_free(g_cell[ord(x)]);
+    g_cell[ord(x) + 1] = g_nil;
+    g_cell[ord(x)] = g_memo_free;
+    g_memo_free = x;
+    ++g_memo_pairs;
+  }
+}
+
+/* Remove the used entry i from its hash bucket chain and free it */
+void memo_drop(unsigned i) {
+  unsigned *p = &g_memo_bucket[g_memo[i].hash % MEMO_SIZE];
+  while (*p != i) {
+    p = &g_memo[*p].next;
+  }
+  *p = g_memo[i].next;
+  g_memo[i].memo = 0;
+  memo_free(g_memo[i].args);
+  memo_free(g_memo[i].value);
+  lru_unlink(i);
+  lru_link(i, 0);
+}
+
+/* Drop the cached results of the memoized functions in reclaimed cells */
+void unmemo() {
+  unsigned i;
+  if (g_memo_low >= g_stack_pointer) {
+    return;
+  }
+  g_memo_low = NCELLS;
+  for (i = 0; i < MEMO_SIZE; ++i) {
+    if (g_memo[i].memo && g_memo[i].memo < g_stack_pointer) {
+      memo_drop(i);
+    } else if (g_memo[i].memo && g_memo[i].memo < g_memo_low) {
+      g_memo_low = g_memo[i].memo;
+    }
+  }
+}
+
+/* Apply memoized function m to the list of arguments t. On a hit a copy of
+ * the cached value is returned, on a miss the oldest entry is reused for the result and
+ * the oldest used entries are dropped until the copies fit */
+LispExpr apply_memo(LispExpr m, LispExpr t, LispExpr e) {
+  LispExpr s = g_cell[ord(m)];
+  LispExpr x;
+  unsigned h, i, n;
+
+  t = evlis(t, e);
+  h = hash(t);
+  for (i = g_memo_bucket[h % MEMO_SIZE]; i != MEMO_SIZE; i = g_memo[i].next) {
+    if (g_memo[i].memo == ord(m) && g_memo[i].hash == h &&
+        equal(g_memo[i].args, t)) {
+      ++g_cell[ord(s) + 1];
+      lru_unlink(i);
+      lru_link(i, 1);
+      return memo_value(g_memo[i].value);
+    }
+  }
+
+  ++g_cell[ord(s)];
+  x = invoke(g_cell[ord(m) + 1], t);
+
+  n = pairs(t) + pairs(x);
+  if (n > MEMO_PAIRS) { // too large to cache
+    return x;
+  }
+  while (g_memo_pairs < n) {
+    for (i = g_memo[MEMO_SIZE].newer; !g_memo[i].memo; i = g_memo[i].newer) {
+      continue;
+    }
+    memo_drop(i);
+  }
+
+  i = g_memo[MEMO_SIZE].newer;
+  if (g_memo[i].memo) {
+    memo_drop(i);
+  }
+  lru_unlink(i);
+  g_memo[i].memo = ord(m);
+  if (ord(m) < g_memo_low) {
+    g_memo_low = ord(m);
+  }
+  g_memo[i].hash = h;
+  g_memo[i].args = memo_copy(t);
+  g_memo[i].value = memo_copy(x);
+  g_memo[i].next = g_memo_bucket[h % MEMO_SIZE];
+  g_memo_bucket[h % MEMO_SIZE] = i;
+  lru_link(i, 1);
+  return x;
+}
+
+LispExpr apply_prim(LispExpr f, LispExpr t, LispExpr e) {
+  return Prim[ord(f)].f(t, e);
+}
+
+LispExpr apply_err(LispExpr f, LispExpr t, LispExpr e) {
+  return err(INV_FUN_TYPE, f);
+}
+
+/* How to apply an f of each tag, indexed by tag(f) */
+LispExpr (*const Apply[NTAGS + 1])(LispExpr, LispExpr, LispExpr) = {
+    apply_err, apply_prim, apply_err,  apply_err, reduce,
+    expand,    apply_err,  apply_memo, apply_err};
+
 /* Apply the primitive or the closure f to the list of arguments t in environment e. */
 LispExpr apply(LispExpr f, LispExpr t, LispExpr e) {
-  return TAG_BITS(f) == g_PRIM   ? Prim[ord(f)].f(t, e)
-         : TAG_BITS(f) == g_CLOS ? reduce(f, t, e)
-         : TAG_BITS(f) == g_MACR ? expand(f, t, e)
-                                 : err(INV_FUN_TYPE);
+  return Apply[tag(f)](f, t, e);
+}
+
+/* Numbers, primitives, closures, macros and nil evaluate to themselves */
+LispExpr step_self(LispExpr x, LispExpr _) { return x; }
+
+/* A list evaluates to its head applied to the rest */
+LispExpr step_cons(LispExpr x, LispExpr e) {
+  return apply(eval(car(x), e), cdr(x), e);
 }
 
+/* How to evaluate an x of each tag, indexed by tag(x) */
+LispExpr (*const Step[NTAGS + 1])(LispExpr, LispExpr) = {
+    assoc,     step_self, step_cons, step_cons, step_self,
+    step_self, step_self, step_self, step_self};
+
 /* The core of `eval`. An expression is either a number, an atom, a primitive,
  * a cons pair, a closure, or nil. Numbers, primitives, closures and nil are constant
  * and returned as they are.
  * Note that an expression x evalutes to the value assoc(x, e) when x is atom, or
- * evaluates to apply(...) if it is a list. */
-LispExpr step(LispExpr x, LispExpr e) {
-  return TAG_BITS(x) == g_ATOM   ? assoc(x, e)
-         : TAG_BITS(x) == g_CONS ? apply(eval(car(x), e), cdr(x), e)
-                                 : x;
+ * evaluates to apply(...) if it is a list.
+ * Dispatch on the tag is a single indexed jump through Step */
+LispExpr step(LispExpr x, LispExpr e) { return Step[tag(x)](x, e); }
+
+/* Maximum number of cells of a closure body to inline at its call sites */
+#define INLINE_SIZE 24
+
+/* Maximum nesting of inlined closure bodies, prevents unbounded inlining of
+ * mutually recursive functions */
+#define INLINE_DEPTH 2
+
+/* Primitives without side effects that may be applied ahead of time to
+ * constant arguments, with the least number of arguments they need */
+struct {
+  LispExpr (*f)(LispExpr, LispExpr);
+  unsigned n;
+} Pure[] = {{f_add, 1}, {f_sub, 1}, {f_mul, 1}, {f_div, 1}, {f_int, 1},
+            {f_lt, 2},  {f_eq, 2},  {f_not, 1}, {f_car, 1}, {f_cdr, 1},
+            {0}};
+
+/* Returns the index of primitive f in Pure, or the index of the
+ * terminating entry if f is not pure */
+unsigned pure(LispExpr f) {
+  unsigned i = 0;
+  while (Pure[i].f && Pure[i].f != Prim[ord(f)].f) {
+    ++i;
+  }
+  return i;
+}
+
+/* Returns the primitive implemented by f */
+LispExpr prim(LispExpr (*f)(LispExpr, LispExpr)) {
+  unsigned i = 0;
+  while (Prim[i].f != f) {
+    ++i;
+  }
+  return box(g_PRIM, i);
+}
+
+/* Check if x is a primitive implemented by f */
+unsigned is_prim(LispExpr x, LispExpr (*f)(LispExpr, LispExpr)) {
+  return TAG_BITS(x) == g_PRIM && Prim[ord(x)].f == f;
+}
+
+/* Check if evaluating x yields a value known ahead of time. Constants are
+ * numbers, nil, primitives, closures and quoted expressions */
+unsigned constant(LispExpr x) {
+  LispExpr t;
+  return is_cons(x)
+             ? is_prim(car(x), f_quote) && (t = cdr(x), is_cons(t))
+             : TAG_BITS(x) != g_ATOM && TAG_BITS(x) != g_MACR;
+}
+
+/* Returns an expression that evaluates to x */
+LispExpr literal(LispExpr x) {
+  return TAG_BITS(x) == g_ATOM || is_cons(x)
+             ? cons(prim(f_quote), cons(x, g_nil))
+             : x;
+}
+
+/* Returns the value of the constant expression x */
+LispExpr value(LispExpr x) { return is_cons(x) ? car(cdr(x)) : x; }
+
+/* Check if the symbol v occurs anywhere in x */
+unsigned occurs(LispExpr v, LispExpr x) {
+  return is_cons(x) ? occurs(v, car(x)) || occurs(v, cdr(x)) : eq(v, x);
+}
+
+/* Check if every symbol in x other than those in v is not one of the locals s,
+ * so that x means the same when evaluated in the scope of s */
+unsigned free_of(LispExpr x, LispExpr v, LispExpr s) {
+  return is_cons(x)
+             ? free_of(car(x), v, s) && free_of(cdr(x), v, s)
+             : TAG_BITS(x) != g_ATOM || occurs(x, v) || !occurs(x, s);
+}
+
+/* Returns the number of cells of x */
+unsigned size(LispExpr x) {
+  return is_cons(x) ? 2 + size(car(x)) + size(cdr(x)) : 0;
+}
+
+/* Returns the number of elements of the list t */
+unsigned count(LispExpr t) {
+  unsigned n = 0;
+  for (; is_cons(t); t = cdr(t)) {
+    ++n;
+  }
+  return n;
+}
+
+/* Check if every element of the proper list t is a symbol */
+unsigned symbols(LispExpr t) {
+  LispExpr v;
+  for (; is_cons(t); t = cdr(t)) {
+    if (v = car(t), TAG_BITS(v) != g_ATOM) {
+      return 0;
+    }
+  }
+  return not(t);
+}
+
+unsigned simple(LispExpr x, LispExpr v);
+
+/* Check if t is a proper list of simple expressions */
+unsigned simple_list(LispExpr t, LispExpr v) {
+  for (; is_cons(t); t = cdr(t)) {
+    if (!simple(car(t), v)) {
+      return 0;
+    }
+  }
+  return not(t);
+}
+
+/* Check if x, the body of a closure with variables v, may be inlined.
+ * Simple expressions only refer to variables and globals, and apply global
+ * closures and primitives that neither bind names nor inspect the
+ * environment, so the body means the same in the scope of any caller */
+unsigned simple(LispExpr x, LispExpr v) {
+  LispExpr f, t;
+  if (!is_cons(x)) {
+    return 1;
+  }
+
+  if (f = car(x), TAG_BITS(f) != g_ATOM || occurs(f, v) ||
+      not(f = binding(f, g_env))) {
+    return 0;
+  }
+
+  f = cdr(f);
+  if (TAG_BITS(f) == g_CLOS) {
+    return simple_list(cdr(x), v);
+  }
+
+  if (is_prim(f, f_quote)) {
+    return 1;
+  }
+
+  if (is_prim(f, f_cond)) {
+    for (t = cdr(x); is_cons(t); t = cdr(t)) {
+      if (!simple_list(car(t), v)) {
+        return 0;
+      }
+    }
+    return not(t);
+  }
+
+  return TAG_BITS(f) == g_PRIM &&
+         (Pure[pure(f)].f || is_prim(f, f_if) || is_prim(f, f_and) ||
+          is_prim(f, f_or) || is_prim(f, f_cons)) &&
+         simple_list(cdr(x), v);
+}
+
+LispExpr fold(LispExpr, LispExpr, unsigned);
+
+/* Fold every expression of the proper list t, returns nil if t is not a
+ * proper list */
+LispExpr fold_list(LispExpr t, LispExpr s, unsigned depth) {
+  LispExpr r;
+  LispExpr *p;
+  for (r = g_nil, p = &r; is_cons(t);
+       p = g_cell + g_stack_pointer, t = cdr(t)) {
+    *p = cons(fold(car(t), s, depth), g_nil);
+  }
+  return not(t) ? r : g_nil;
+}
+
+/* Check if every expression of the list t is constant */
+unsigned constants(LispExpr t) {
+  for (; is_cons(t); t = cdr(t)) {
+    if (!constant(car(t))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Fold the clauses of (cond ...) x, dropping the clauses whose test is
+ * constant (). If the first clause left has a constant non-() test, it gives
+ * the expression of that clause */
+LispExpr fold_cond(LispExpr f, LispExpr x, LispExpr s, unsigned depth) {
+  LispExpr r, c, y;
+  LispExpr t = cdr(x);
+  LispExpr *p;
+  for (r = g_nil, p = &r; is_cons(t); t = cdr(t)) {
+    if (c = car(t), !is_cons(c) || (y = cdr(c), !is_cons(y))) {
+      return x;
+    }
+
+    c = fold(car(c), s, depth);
+    y = fold(car(y), s, depth);
+    if (constant(c) && not(value(c))) {
+      continue;
+    }
+
+    if (constant(c) && not(r)) {
+      return y;
+    }
+
+    *p = cons(cons(c, cons(y, g_nil)), g_nil);
+    p = g_cell + g_stack_pointer;
+    if (constant(c)) {
+      return cons(f, r);
+    }
+  }
+  return not(r) || !not(t) ? x : cons(f, r);
+}
+
+/* Replace the variable v by the constant c in the simple expression x. Quoted
+ * expressions are left as they are */
+LispExpr subst(LispExpr x, LispExpr v, LispExpr c) {
+  LispExpr f;
+  if (!is_cons(x)) {
+    return eq(x, v) ? c : x;
+  }
+
+  if (f = car(x), TAG_BITS(f) == g_ATOM && !not(f = binding(f, g_env)) &&
+      is_prim(cdr(f), f_quote)) {
+    return x;
+  }
+
+  f = subst(car(x), v, c);
+  return cons(f, subst(cdr(x), v, c));
+}
+
+/* Returns the body of closure f as written. The body of an optimized closure
+ * is its guard, whose last expression is the original body */
+LispExpr body(LispExpr f) {
+  LispExpr y = cdr(car(f));
+  return is_cons(y) && is_prim(car(y), f_guard) ? car(cdr(cdr(cdr(y)))) : y;
+}
+
+/* Replace the call x of global closure f by the folded body of f. Constant
+ * arguments in t are substituted for their variables, a let binds the
+ * variables to the other folded arguments */
+LispExpr inline_call(LispExpr f, LispExpr x, LispExpr t, LispExpr s,
+                     unsigned depth) {
+  LispExpr v = car(car(f));
+  LispExpr y = body(f);
+  LispExpr r, w;
+  LispExpr *p;
+  if (depth == 0 || !not(cdr(f)) || !symbols(v) || count(v) != count(t) ||
+      occurs(car(x), y) ||
+      size(y) > INLINE_SIZE || !simple(y, v) || !free_of(y, v, s)) {
+    return cons(f, t);
+  }
+
+  for (r = cons(prim(f_let), g_nil), p = g_cell + g_stack_pointer, w = g_nil;
+       is_cons(v); v = cdr(v), t = cdr(t)) {
+    if (constant(car(t)) && (y = subst(y, car(v), car(t)), !occurs(car(v), y))) {
+      continue;
+    }
+
+    *p = cons(cons(car(v), cons(car(t), g_nil)), g_nil);
+    p = g_cell + g_stack_pointer;
+    w = cons(car(v), w);
+  }
+
+  y = fold(y, cons(w, s), depth - 1);
+  if (not(w)) {
+    return y;
+  }
+
+  *p = cons(y, g_nil);
+  return r;
+}
+
+/* Partially evaluate the expression x with local variables s. Globals bound
+ * to primitives, closures and themselves are replaced by their values,
+ * pure primitives applied to constants are replaced by their results, dead
+ * if and cond branches are removed and small global closures are inlined.
+ * Forms that bind names or whose arguments are not evaluated, such as let,
+ * lambda and macros, are left as they are */
+LispExpr fold(LispExpr x, LispExpr s, unsigned depth) {
+  LispExpr f, t, c;
+  if (TAG_BITS(x) == g_ATOM) {
+    return occurs(x, s) || not(f = binding(x, g_env)) ||
+                   !foldable(x, cdr(f))
+               ? x
+               : literal(cdr(f));
+  }
+
+  if (!is_cons(x)) {
+    return x;
+  }
+
+  f = fold(car(x), s, depth);
+  if (TAG_BITS(f) == g_CLOS) {
+    return not(t = fold_list(cdr(x), s, depth)) && !not(cdr(x))
+               ? x
+               : inline_call(f, x, t, s, depth);
+  }
+
+  if (TAG_BITS(f) != g_PRIM) {
+    return x;
+  }
+
+  if (is_prim(f, f_cond)) {
+    return fold_cond(f, x, s, depth);
+  }
+
+  if (!Pure[pure(f)].f && !is_prim(f, f_if) && !is_prim(f, f_and) &&
+      !is_prim(f, f_or) && !is_prim(f, f_cons) && !is_prim(f, f_eval) &&
+      !is_prim(f, f_print) && !is_prim(f, f_println) &&
+      !is_prim(f, f_catch)) {
+    return cons(f, cdr(x));
+  }
+
+  if (not(t = fold_list(cdr(x), s, depth)) && !not(cdr(x))) {
+    return x;
+  }
+
+  if (is_prim(f, f_if) && !not(t) && constant(c = car(t))) {
+    if (!not(value(c)) && count(t) >= 2) {
+      return car(cdr(t));
+    }
+    if (not(value(c)) && count(t) >= 3) {
+      return car(cdr(cdr(t)));
+    }
+  }
+
+  if (Pure[pure(f)].f && constants(t) && count(t) >= Pure[pure(f)].n &&
+      ((!is_prim(f, f_car) && !is_prim(f, f_cdr)) || is_cons(value(car(t))))) {
+    return literal(Prim[ord(f)].f(t, g_env));
+  }
+
+  return cons(f, t);
+}
+
+/* Optimize the body x of a top-level closure with variables v. The folded
+ * body is guarded by the current stamp and falls back to x as soon as a
+ * global folded into it is redefined */
+LispExpr optimize(LispExpr v, LispExpr x) {
+  LispExpr y = fold(x, v, INLINE_DEPTH);
+  return cons(prim(f_guard),
+              cons(g_stamp, cons(y, cons(x, g_nil))));
 }
 
 /* Advance to the next character in input buffer, also works when reading from file */
@@ -640,26 +1486,41 @@ LispExpr read() {
   return parse();
 }
 
-/* Return a parsed Lisp list */
-LispExpr list() {
-  LispExpr t;
-  LispExpr *p;
-  for (t = g_nil, p = &t;;
-       *p = cons(parse(), g_nil), p = g_cell + g_stack_pointer) {
-    if (scan() == ')') {
-      return t;
-    }
-
+/* Return the parsed rest of a Lisp list, cdr-coded, starting with the token
+ * in the buffer */
+LispExpr elements() {
+  LispExpr v[CHUNK_SIZE];
+  unsigned n = 0;
+  LispExpr t = g_nil;
+  for (; *g_buf != ')'; scan()) {
     if (*g_buf == '.' && !g_buf[1]) {
-      *p = read();
+      t = read();
       scan();
-      return t;
+      break;
+    }
+
+    if (n == CHUNK_SIZE) {
+      t = elements();
+      break;
     }
+    v[n++] = parse();
   }
+  return cdr_code(v, n, t);
+}
+
+/* Return a parsed Lisp list */
+LispExpr list() {
+  scan();
+  return elements();
 }
 
 /* Reterun a parsed Lisp expression x quoted as (quote x) */
-LispExpr quote() { return cons(atom("quote"), cons(read(), g_nil)); }
+LispExpr quote() {
+  LispExpr v[2];
+  v[0] = atom("quote");
+  v[1] = read();
+  return cdr_code(v, 2, g_nil);
+}
 
 /* Return a parsed atomic Lisp expression (a number or an atom) */
 LispExpr atomic() {
@@ -680,7 +1541,7 @@ void printlist(LispExpr t) {
 
     if (TAG_BITS(t) == g_NIL) {
       break;
-    } else if (TAG_BITS(t) != g_CONS) {
+    } else if (!is_cons(t)) {
       printf(" . ");
       print(t);
       break;
@@ -698,27 +1559,46 @@ void print(LispExpr x) {
     printf("%s", ATOM_HEAP_ADDR + ord(x));
   } else if (TAG_BITS(x) == g_PRIM) {
     printf("<%s>", Prim[ord(x)].s);
-  } else if (TAG_BITS(x) == g_CONS) {
+  } else if (is_cons(x)) {
     printlist(x);
-  } else if (TAG_BITS(x) == g_CLOS) {
+  } else if (TAG_BITS(x) == g_CLOS || TAG_BITS(x) == g_MEMO) {
     printf("{%u}", ord(x));
   } else {
     printf("%.10lg", x);
   }
 }
 
+/* Raise the heap pointer to the name of x if x is an atom */
+void keep_atom(LispExpr x) {
+  if (TAG_BITS(x) == g_ATOM && ord(x) > g_heap_pointer) {
+    g_heap_pointer = ord(x);
+  }
+}
+
 /* Garbage collection. Remove all temporary cells from the stack.
  * Also removes unused atoms from the heap.
  * Preserves all globally-defined names and functions
- * listed in the global environment */
+ * listed in the global environment.
+ * Cached results of memoized functions are kept as long as the function
+ * survives, their copies above NCELLS are left alone */
 void gc() {
+  unsigned i;
   g_stack_pointer = ord(g_env); // restore the stack ptr to the point on the stack
                                 // where the free space begins
+  if (g_kept < g_stack_pointer) { // or below the pairs set-cdr! forwarded to
+    g_stack_pointer = g_kept;
+  }
+  g_pinned = g_stack_pointer;
+  unmemo();                     // drop the cached results of reclaimed functions
 
-  unsigned i = g_stack_pointer;
-  for (g_heap_pointer = 0; i < NCELLS; ++i) { // find the max heap reference among the used ATOM-tagged cells
-    if (TAG_BITS(g_cell[i]) == g_ATOM && ord(g_cell[i]) > g_heap_pointer) {
-      g_heap_pointer = ord(g_cell[i]);
+  g_heap_pointer = 0;
+  for (i = g_stack_pointer; i < NCELLS + 2 * MEMO_PAIRS; ++i) { // find the max heap reference among the used ATOM-tagged cells
+    keep_atom(g_cell[i]);                                          // and the cached results
+  }
+  for (i = 0; i < MEMO_SIZE; ++i) { // and the cached results kept outside pairs
+    if (g_memo[i].memo) {
+      keep_atom(g_memo[i].args);
+      keep_atom(g_memo[i].value);
     }
   }
 
@@ -739,18 +1619,37 @@ int main(int argc, char **argv) {
     g_env = pair(atom(Prim[i].s), box(g_PRIM, i), g_env);
   }
 
+  g_memo[MEMO_SIZE].newer = g_memo[MEMO_SIZE].older = MEMO_SIZE;
+  for (unsigned i = 0; i < MEMO_SIZE; ++i) {
+    g_memo_bucket[i] = MEMO_SIZE;
+    lru_link(i, 0);
+  }
+  g_memo_free = g_nil;
+  for (unsigned i = NCELLS; i < NCELLS + 2 * MEMO_PAIRS; i += 2) {
+    g_cell[i + 1] = g_nil;
+    g_cell[i] = g_memo_free;
+    g_memo_free = box(g_CONS, i);
+  }
+
   if (argc > 1) {
     g_in = fopen((strcmp(argv[1], "p") == 0) ? "prelude.lisp" : argv[1], "r");
   }
 
   using_history();
 
-  int jmp_status;
-  if ((jmp_status = setjmp(g_jmp_context)) != 0) {
-    printf("ERR %d", jmp_status);
+  static Handler repl; // static, it is modified after setjmp
+  int status;
+  if ((status = setjmp(repl.context)) != 0) {
+    printf("ERR %d", status);
+    if (!not(g_culprit)) {
+      putchar(' ');
+      print(g_culprit);
+    }
   }
   while (1) {
     gc();
+    repl.stack_pointer = g_stack_pointer;
+    g_handler = &repl;
     putchar('\n');
     snprintf(g_prompt, PROMPT_SIZE, "%u>",
              g_stack_pointer - g_heap_pointer / 8);